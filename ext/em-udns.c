@@ -4,6 +4,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
 #include "udns.h"
 #include "em-udns.h"
 
@@ -32,6 +38,7 @@ static ID id_flags;
 static ID id_service;
 static ID id_regexp;
 static ID id_replacement;
+static ID id_ttl;
 
 static VALUE symbol_dns_error_tempfail;
 static VALUE symbol_dns_error_protocol;
@@ -46,30 +53,101 @@ static ID method_cancel;
 static ID method_set_timer;
 static ID method_do_success;
 static ID method_do_error;
+static ID method_native_drain;
 
 
-void Resolver_free(struct dns_ctx *dns_context)
+static int default_context_initialized = 0;
+
+
+/* (Re)initializes the udns default context by reading /etc/resolv.conf and
+ * the environment. Resolvers copy it, so it's done just once unless
+ * explicitly requested. */
+static int init_default_context(void)
+{
+  if (dns_init(NULL, 0) < 0) {
+    default_context_initialized = 0;
+    return -1;
+  }
+  default_context_initialized = 1;
+  return 0;
+}
+
+
+VALUE Udns_dns_init(VALUE self)
+{
+  if (init_default_context() < 0)
+    rb_raise(eUdnsError, "udns `dns_init' failed");
+
+  return Qtrue;
+}
+
+
+static void result_SRV_glue(int status, void *result, void *data);
+static void srv_glue_free(struct srv_glue_result *result);
+
+
+/* Frees the results queued by native_poll() which were not delivered. */
+static void free_pending(struct resolver *resolver)
+{
+  struct pending_result *pending;
+
+  while ((pending = resolver->pending_head)) {
+    resolver->pending_head = pending->next;
+    if (pending->fn == (result_fn)result_SRV_glue)
+      srv_glue_free(pending->rr);
+    else if (pending->rr)
+      free(pending->rr);
+    xfree(pending->data);
+    free(pending);
+  }
+  resolver->pending_tail = NULL;
+}
+
+
+void Resolver_free(struct resolver *resolver)
 {
-  if(dns_context)
-    dns_free(dns_context);
+  int i;
+
+  free_pending(resolver);
+  if (resolver->context)
+    dns_free(resolver->context);
+  for(i = 0; i < resolver->ndraining; i++)
+    dns_free(resolver->draining[i]);
+  if (resolver->draining)
+    xfree(resolver->draining);
+  if (resolver->wake[0] >= 0) {
+    close(resolver->wake[0]);
+    close(resolver->wake[1]);
+  }
+  xfree(resolver);
 }
 
 
 VALUE Resolver_alloc(VALUE klass)
 {
-  struct dns_ctx *dns_context;
+  struct resolver *resolver;
   VALUE alloc_error = Qnil;
   VALUE obj;
 
+  resolver = ALLOC(struct resolver);
+  resolver->context = NULL;
+  resolver->draining = NULL;
+  resolver->ndraining = 0;
+  resolver->native = 0;
+  resolver->stop = 0;
+  resolver->wake[0] = resolver->wake[1] = -1;
+  resolver->timer_ms = -1;
+  resolver->pending_head = resolver->pending_tail = NULL;
+
   /* First initialize the library (so the default context). */
-  if (dns_init(NULL, 0) < 0)
+  if (!default_context_initialized && init_default_context() < 0)
     alloc_error = rb_str_new2("udns `dns_init' failed");
 
   /* Copy the context to a new one. */
-  if (!(dns_context = dns_new(NULL)))
+  else if (!(resolver->context = dns_new(NULL)))
     alloc_error = rb_str_new2("udns `dns_new' failed");
   
-  obj = Data_Wrap_Struct(klass, NULL, Resolver_free, dns_context);
+  obj = Data_Wrap_Struct(klass, NULL, Resolver_free, resolver);
   if (TYPE(alloc_error) == T_STRING)
     rb_ivar_set(obj, rb_intern("@alloc_error"), alloc_error);
 
@@ -77,6 +155,21 @@ VALUE Resolver_alloc(VALUE klass)
 }
 
 
+static struct resolver *get_resolver(VALUE self)
+{
+  struct resolver *resolver;
+
+  Data_Get_Struct(self, struct resolver, resolver);
+  return resolver;
+}
+
+
+static struct dns_ctx *get_dns_context(VALUE self)
+{
+  return get_resolver(self)->context;
+}
+
+
 void timer_cb(struct dns_ctx *dns_context, int timeout, void *data)
 {
   VALUE resolver;
@@ -98,9 +191,11 @@ VALUE Resolver_dns_open(VALUE self)
 {
   struct dns_ctx *dns_context = NULL;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
 
-  dns_set_tmcbck(dns_context, timer_cb, (void*)self);
+  /* In native loop mode timeouts are handled by native_poll(). */
+  if (!get_resolver(self)->native)
+    dns_set_tmcbck(dns_context, timer_cb, (void*)self);
   
   /* Open the new context. */
   if (dns_open(dns_context) < 0)
@@ -110,31 +205,300 @@ VALUE Resolver_dns_open(VALUE self)
 }
 
 
+/* Replaces the context with a new (not yet opened) copy of the default one.
+ * The previous context keeps running its pending queries until they finish
+ * (see Resolver_free_drained). */
+VALUE Resolver_dns_renew(VALUE self)
+{
+  struct resolver *resolver;
+  struct dns_ctx *dns_context;
+
+  Data_Get_Struct(self, struct resolver, resolver);
+
+  if (!(dns_context = dns_new(NULL)))
+    rb_raise(eUdnsError, "udns `dns_new' failed");
+
+  /* Its timeouts are processed by Resolver_timeouts from now on. */
+  dns_set_tmcbck(resolver->context, NULL, NULL);
+
+  REALLOC_N(resolver->draining, struct dns_ctx *, resolver->ndraining + 1);
+  resolver->draining[resolver->ndraining++] = resolver->context;
+  resolver->context = dns_context;
+
+  return Qtrue;
+}
+
+
+/* Sockets of the previous contexts. */
+VALUE Resolver_draining_fds(VALUE self)
+{
+  struct resolver *resolver;
+  VALUE array;
+  int i;
+
+  Data_Get_Struct(self, struct resolver, resolver);
+
+  array = rb_ary_new();
+  for(i = 0; i < resolver->ndraining; i++)
+    rb_ary_push(array, INT2FIX(dns_sock(resolver->draining[i])));
+
+  return array;
+}
+
+
+/* Sockets of the previous contexts with no pending queries, which are
+ * closed by Resolver_free_drained. */
+VALUE Resolver_drained_fds(VALUE self)
+{
+  struct resolver *resolver;
+  VALUE array;
+  int i;
+
+  Data_Get_Struct(self, struct resolver, resolver);
+
+  array = rb_ary_new();
+  for(i = 0; i < resolver->ndraining; i++)
+    if (dns_active(resolver->draining[i]) == 0)
+      rb_ary_push(array, INT2FIX(dns_sock(resolver->draining[i])));
+
+  return array;
+}
+
+
+VALUE Resolver_free_drained(VALUE self)
+{
+  struct resolver *resolver;
+  int i, j;
+
+  Data_Get_Struct(self, struct resolver, resolver);
+
+  for(i = 0, j = 0; i < resolver->ndraining; i++) {
+    if (dns_active(resolver->draining[i]) == 0)
+      dns_free(resolver->draining[i]);
+    else
+      resolver->draining[j++] = resolver->draining[i];
+  }
+  resolver->ndraining = j;
+
+  return INT2FIX(resolver->ndraining);
+}
+
+
+static void native_unblock(void *data)
+{
+  struct resolver *resolver = (struct resolver *)data;
+  ssize_t written;
+
+  /* Nothing to do if the pipe is full, poll() will return anyway. */
+  written = write(resolver->wake[1], "", 1);
+  (void)written;
+}
+
+
+/* Native loop mode requires releasing the GVL while waiting in poll()
+ * (Ruby >= 2.0), otherwise no other thread could submit queries. */
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+
+/* Native loop mode: poll() the sockets, receive and parse the responses
+ * and retransmit queries without the GVL. */
+static void *native_poll(void *data)
+{
+  struct resolver *resolver = (struct resolver *)data;
+  struct pollfd *fds;
+  int nfds;
+  int timeout;
+  int t;
+  int i;
+  char buf[64];
+
+  /* Sends the new queries and retransmits the timed out ones. */
+  timeout = dns_timeouts(resolver->context, -1, 0);
+  for(i = 0; i < resolver->ndraining; i++)
+    if ((t = dns_timeouts(resolver->draining[i], -1, 0)) >= 0 && (timeout < 0 || t < timeout))
+      timeout = t;
+  timeout = (timeout < 0) ? -1 : timeout * 1000;
+  if (resolver->timer_ms >= 0 && (timeout < 0 || resolver->timer_ms < timeout))
+    timeout = resolver->timer_ms;
+
+  nfds = 2 + resolver->ndraining;
+  if (!(fds = malloc(nfds * sizeof(struct pollfd))))
+    return NULL;
+  fds[0].fd = resolver->wake[0];
+  fds[1].fd = dns_sock(resolver->context);
+  for(i = 0; i < resolver->ndraining; i++)
+    fds[2 + i].fd = dns_sock(resolver->draining[i]);
+  for(i = 0; i < nfds; i++) {
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+
+  if (!resolver->stop && poll(fds, nfds, timeout) > 0) {
+    if (fds[0].revents)
+      while (read(resolver->wake[0], buf, sizeof(buf)) > 0);
+    if (fds[1].revents)
+      dns_ioevent(resolver->context, 0);
+    for(i = 0; i < resolver->ndraining; i++)
+      if (fds[2 + i].revents)
+        dns_ioevent(resolver->draining[i], 0);
+  }
+  free(fds);
+
+  dns_timeouts(resolver->context, -1, 0);
+  for(i = 0; i < resolver->ndraining; i++)
+    dns_timeouts(resolver->draining[i], -1, 0);
+
+  return NULL;
+}
+
+
+/* Converts the results queued by native_poll(), with the GVL. */
+static void deliver_pending(struct resolver *resolver)
+{
+  struct pending_result *pending;
+
+  while ((pending = resolver->pending_head)) {
+    /* Dequeued first as the Ruby callbacks could raise. */
+    if (!(resolver->pending_head = pending->next))
+      resolver->pending_tail = NULL;
+    pending->fn(pending->status, pending->rr, pending->data);
+    free(pending);
+  }
+}
+
+
+static VALUE native_loop_run(VALUE self)
+{
+  struct resolver *resolver;
+  VALUE timer_ms;
+  int i;
+
+  resolver = get_resolver(self);
+
+  if (resolver->wake[0] < 0) {
+    if (pipe(resolver->wake) < 0)
+      rb_sys_fail("pipe");
+    for(i = 0; i < 2; i++)
+      fcntl(resolver->wake[i], F_SETFL, fcntl(resolver->wake[i], F_GETFL) | O_NONBLOCK);
+  }
+  resolver->native = 1;
+  dns_set_tmcbck(resolver->context, NULL, NULL);
+
+  /* Results received before an exception was raised in a callback. */
+  deliver_pending(resolver);
+
+  while (!resolver->stop) {
+    /* Submits the queries requested by other threads and runs the due Ruby
+     * timers. */
+    timer_ms = rb_funcall(self, method_native_drain, 0);
+    resolver->timer_ms = FIX2INT(timer_ms);
+    if (resolver->stop)
+      break;
+
+    rb_thread_call_without_gvl(native_poll, resolver, native_unblock, resolver);
+    deliver_pending(resolver);
+    Resolver_free_drained(self);
+    rb_thread_check_ints();
+  }
+
+  return Qnil;
+}
+
+
+/* Also run when a callback raised, so the loop can be started again. */
+static VALUE native_loop_end(VALUE self)
+{
+  struct resolver *resolver;
+
+  resolver = get_resolver(self);
+  resolver->native = 0;
+  resolver->stop = 0;
+
+  return Qnil;
+}
+
+
+VALUE Resolver_native_loop(VALUE self)
+{
+  return rb_ensure(native_loop_run, self, native_loop_end, self);
+}
+
+#endif
+
+
+/* Drops the results received by the native loop which were not delivered
+ * when it stopped. */
+VALUE Resolver_drop_pending(VALUE self)
+{
+  struct resolver *resolver;
+  struct pending_result *pending;
+  VALUE queries;
+
+  resolver = get_resolver(self);
+  queries = rb_ivar_get(self, id_queries);
+  for(pending = resolver->pending_head; pending; pending = pending->next)
+    rb_hash_delete(queries, ((struct resolver_query *)pending->data)->query);
+  free_pending(resolver);
+
+  return Qnil;
+}
+
+
+VALUE Resolver_native_wakeup(VALUE self)
+{
+  struct resolver *resolver;
+
+  resolver = get_resolver(self);
+  if (resolver->wake[1] >= 0)
+    native_unblock(resolver);
+
+  return Qnil;
+}
+
+
+VALUE Resolver_native_stop(VALUE self)
+{
+  struct resolver *resolver;
+
+  resolver = get_resolver(self);
+  resolver->stop = 1;
+  if (resolver->wake[1] >= 0)
+    native_unblock(resolver);
+
+  return Qnil;
+}
+
+
 VALUE Resolver_fd(VALUE self)
 {
   struct dns_ctx *dns_context = NULL;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   return INT2FIX(dns_sock(dns_context));
 }
 
 
 VALUE Resolver_ioevent(VALUE self)
 {
-  struct dns_ctx *dns_context = NULL;
+  struct resolver *resolver;
+  int i;
     
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
-  dns_ioevent(dns_context, 0);
+  Data_Get_Struct(self, struct resolver, resolver);
+  dns_ioevent(resolver->context, 0);
+  for(i = 0; i < resolver->ndraining; i++)
+    dns_ioevent(resolver->draining[i], 0);
   return Qfalse;
 }
 
 
 VALUE Resolver_timeouts(VALUE self)
 {
-  struct dns_ctx *dns_context = NULL;
+  struct resolver *resolver;
+  int i;
   
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
-  dns_timeouts(dns_context, -1, 0);
+  Data_Get_Struct(self, struct resolver, resolver);
+  dns_timeouts(resolver->context, -1, 0);
+  for(i = 0; i < resolver->ndraining; i++)
+    dns_timeouts(resolver->draining[i], -1, 0);
 
   return Qnil;
 }
@@ -156,20 +520,24 @@ VALUE Resolver_cancel(VALUE self, VALUE query)
 
 VALUE Resolver_active(VALUE self)
 {
-  struct dns_ctx *dns_context = NULL;
+  struct resolver *resolver;
+  int active;
+  int i;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
-  return INT2FIX(dns_active(dns_context));
+  Data_Get_Struct(self, struct resolver, resolver);
+  active = dns_active(resolver->context);
+  for(i = 0; i < resolver->ndraining; i++)
+    active += dns_active(resolver->draining[i]);
+  return INT2FIX(active);
 }
 
 
-static void* check_query(struct dns_ctx *dns_context, void *rr, void *data)
+static void* check_query(int status, void *rr, void *data)
 {
   VALUE resolver;
   VALUE query;
   VALUE query_value_in_hash;
   VALUE error;
-  int status;
 
   resolver = ((struct resolver_query*)data)->resolver;
   query    = ((struct resolver_query*)data)->query;
@@ -187,7 +555,7 @@ static void* check_query(struct dns_ctx *dns_context, void *rr, void *data)
     return NULL;
   }
   
-  if ((status = dns_status(dns_context)) < 0) {
+  if (status < 0) {
     if (rr) free(rr);
     switch(status) {
       case DNS_E_TEMPFAIL:
@@ -210,18 +578,54 @@ static void* check_query(struct dns_ctx *dns_context, void *rr, void *data)
     return NULL;
   }
 
+  /* Every dns_rr_XXX struct starts with the common fields so the TTL can be
+   * read through dns_rr_null. It's used by the Ruby cache. */
+  if (rr)
+    rb_ivar_set(query, id_ttl, INT2FIX(((struct dns_rr_null *)rr)->dnsn_ttl));
+
   return (void*)query;
 }
 
 
-static void dns_result_A_cb(struct dns_ctx *dns_context, struct dns_rr_a4 *rr, void *data)
+/* Converts the result now, or queues it if it was received by native_poll()
+ * (without the GVL, so no Ruby object can be created). */
+static void dispatch_result(struct dns_ctx *dns_context, result_fn fn, void *rr, void *data)
+{
+  struct resolver *resolver = ((struct resolver_query*)data)->owner;
+  struct pending_result *pending;
+
+  if (!resolver->native) {
+    fn(dns_status(dns_context), rr, data);
+    return;
+  }
+
+  /* Plain malloc() as xmalloc() requires the GVL. On failure the query is
+   * lost, as udns does when it can't allocate the result. */
+  if (!(pending = malloc(sizeof(struct pending_result)))) {
+    if (rr) free(rr);
+    return;
+  }
+  pending->fn = fn;
+  pending->status = dns_status(dns_context);
+  pending->rr = rr;
+  pending->data = data;
+  pending->next = NULL;
+  if (resolver->pending_tail)
+    resolver->pending_tail->next = pending;
+  else
+    resolver->pending_head = pending;
+  resolver->pending_tail = pending;
+}
+
+
+static void result_A(int status, struct dns_rr_a4 *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
   char ip[INET_ADDRSTRLEN];
   
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
   
   array = rb_ary_new2(rr->dnsa4_nrr);
   for(i = 0; i < rr->dnsa4_nrr; i++)
@@ -232,14 +636,14 @@ static void dns_result_A_cb(struct dns_ctx *dns_context, struct dns_rr_a4 *rr, v
 }
 
 
-static void dns_result_AAAA_cb(struct dns_ctx *dns_context, struct dns_rr_a6 *rr, void *data)
+static void result_AAAA(int status, struct dns_rr_a6 *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
   char ip[INET6_ADDRSTRLEN];
 
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
 
   array = rb_ary_new2(rr->dnsa6_nrr);
   for(i = 0; i < rr->dnsa6_nrr; i++)
@@ -250,13 +654,13 @@ static void dns_result_AAAA_cb(struct dns_ctx *dns_context, struct dns_rr_a6 *rr
 }
 
 
-static void dns_result_PTR_cb(struct dns_ctx *dns_context, struct dns_rr_ptr *rr, void *data)
+static void result_PTR(int status, struct dns_rr_ptr *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
   
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
 
   array = rb_ary_new2(rr->dnsptr_nrr);
   for(i = 0; i < rr->dnsptr_nrr; i++)
@@ -267,14 +671,14 @@ static void dns_result_PTR_cb(struct dns_ctx *dns_context, struct dns_rr_ptr *rr
 }
 
 
-static void dns_result_MX_cb(struct dns_ctx *dns_context, struct dns_rr_mx *rr, void *data)
+static void result_MX(int status, struct dns_rr_mx *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
   VALUE rr_mx;
 
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
 
   array = rb_ary_new2(rr->dnsmx_nrr);
   for(i = 0; i < rr->dnsmx_nrr; i++) {
@@ -288,13 +692,13 @@ static void dns_result_MX_cb(struct dns_ctx *dns_context, struct dns_rr_mx *rr,
   rb_funcall(query, method_do_success, 1, array);
 }
 
-static void dns_result_NS_cb(struct dns_ctx *dns_context, struct dns_rr_ns *rr, void *data)
+static void result_NS(int status, struct dns_rr_ns *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
 
-  if (!(query = (VALUE)check_query(dns_context, rr, data))) return;
+  if (!(query = (VALUE)check_query(status, rr, data))) return;
 
   array = rb_ary_new2(rr->dnsns_nrr);
   for(i = 0; i < rr->dnsns_nrr; i++) {
@@ -307,13 +711,13 @@ static void dns_result_NS_cb(struct dns_ctx *dns_context, struct dns_rr_ns *rr,
 
 
 
-static void dns_result_TXT_cb(struct dns_ctx *dns_context, struct dns_rr_txt *rr, void *data)
+static void result_TXT(int status, struct dns_rr_txt *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
 
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
 
   array = rb_ary_new2(rr->dnstxt_nrr);
   for(i = 0; i < rr->dnstxt_nrr; i++)
@@ -324,14 +728,14 @@ static void dns_result_TXT_cb(struct dns_ctx *dns_context, struct dns_rr_txt *rr
 }
 
 
-static void dns_result_SRV_cb(struct dns_ctx *dns_context, struct dns_rr_srv *rr, void *data)
+static void result_SRV(int status, struct dns_rr_srv *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
   VALUE rr_srv;
 
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
 
   array = rb_ary_new2(rr->dnssrv_nrr);
   for(i = 0; i < rr->dnssrv_nrr; i++) {
@@ -348,14 +752,14 @@ static void dns_result_SRV_cb(struct dns_ctx *dns_context, struct dns_rr_srv *rr
 }
 
 
-static void dns_result_NAPTR_cb(struct dns_ctx *dns_context, struct dns_rr_naptr *rr, void *data)
+static void result_NAPTR(int status, struct dns_rr_naptr *rr, void *data)
 {
   VALUE query;
   VALUE array;
   int i;
   VALUE rr_naptr;
 
-  if (!(query = (VALUE)check_query(dns_context, rr, data)))  return;
+  if (!(query = (VALUE)check_query(status, rr, data)))  return;
 
   array = rb_ary_new2(rr->dnsnaptr_nrr);
   for(i = 0; i < rr->dnsnaptr_nrr; i++) {
@@ -380,6 +784,168 @@ static void dns_result_NAPTR_cb(struct dns_ctx *dns_context, struct dns_rr_naptr
 }
 
 
+static void srv_glue_free(struct srv_glue_result *result)
+{
+  if (!result)
+    return;
+  if (result->srv)
+    free(result->srv);
+  if (result->glue)
+    free(result->glue);
+  free(result);
+}
+
+
+/* Parses the SRV records as dns_parse_srv() and also collects the A and
+ * AAAA records of the additional section, so targets don't need to be
+ * resolved again. */
+static int dns_parse_srv_glue(dnscc_t *qdn, dnscc_t *pkt, dnscc_t *cur, dnscc_t *end, void **result)
+{
+  struct srv_glue_result *ret;
+  struct dns_rr_srv *srv;
+  struct dns_parse p;
+  struct dns_rr rr;
+  int nar;
+  int r;
+
+  if ((r = dns_parse_srv(qdn, pkt, cur, end, (void **)&srv)) < 0)
+    return r;
+
+  if (!(ret = calloc(1, sizeof(struct srv_glue_result)))) {
+    free(srv);
+    return DNS_E_NOMEM;
+  }
+  ret->srv = srv;
+
+  if ((nar = dns_numar(pkt)) > 0 && (ret->glue = calloc(nar, sizeof(struct srv_glue)))) {
+    /* Walk every record with no name/type filter, keeping only those of
+     * the additional section (the last `nar' ones). */
+    dns_initparse(&p, NULL, pkt, cur, end);
+    p.dnsp_rrl = dns_numan(pkt) + dns_numns(pkt) + nar;
+    p.dnsp_qtyp = 0;
+    while (ret->nglue < nar && dns_nextrr(&p, &rr) > 0) {
+      if (p.dnsp_rrl >= nar)
+        continue;
+      if (rr.dnsrr_typ == DNS_T_A && rr.dnsrr_dsz == 4) {
+        ret->glue[ret->nglue].family = AF_INET;
+        memcpy(&(ret->glue[ret->nglue].addr.addr4), rr.dnsrr_dptr, 4);
+      }
+      else if (rr.dnsrr_typ == DNS_T_AAAA && rr.dnsrr_dsz == 16) {
+        ret->glue[ret->nglue].family = AF_INET6;
+        memcpy(&(ret->glue[ret->nglue].addr.addr6), rr.dnsrr_dptr, 16);
+      }
+      else
+        continue;
+      dns_dntop(rr.dnsrr_dn, ret->glue[ret->nglue].name, DNS_MAXNAME);
+      ret->nglue++;
+    }
+  }
+
+  *result = ret;
+  return 0;
+}
+
+
+/* Invokes the callback with a two elements Array: the RR_SRV objects and a
+ * Hash of target => Array of glue addresses. */
+static void result_SRV_glue(int status, void *result, void *data)
+{
+  struct srv_glue_result *rr = (struct srv_glue_result *)result;
+  VALUE query;
+  VALUE array;
+  VALUE glue;
+  VALUE addresses;
+  VALUE name;
+  int i;
+  VALUE rr_srv;
+  char ip[INET6_ADDRSTRLEN];
+
+  /* NULL is passed so check_query() doesn't free() the result (it has its
+   * own free function), so the TTL is set here. */
+  if (!(query = (VALUE)check_query(status, NULL, data))) {
+    srv_glue_free(rr);
+    return;
+  }
+  rb_ivar_set(query, id_ttl, INT2FIX(rr->srv->dnssrv_ttl));
+
+  array = rb_ary_new2(rr->srv->dnssrv_nrr);
+  for(i = 0; i < rr->srv->dnssrv_nrr; i++) {
+    rr_srv = rb_obj_alloc(cRR_SRV);
+    rb_ivar_set(rr_srv, id_domain, rb_str_new2(rr->srv->dnssrv_srv[i].name));
+    rb_ivar_set(rr_srv, id_priority, INT2FIX(rr->srv->dnssrv_srv[i].priority));
+    rb_ivar_set(rr_srv, id_weight, INT2FIX(rr->srv->dnssrv_srv[i].weight));
+    rb_ivar_set(rr_srv, id_port, INT2FIX(rr->srv->dnssrv_srv[i].port));
+    rb_ary_push(array, rr_srv);
+  }
+
+  glue = rb_hash_new();
+  for(i = 0; i < rr->nglue; i++) {
+    name = rb_str_new2(rr->glue[i].name);
+    if (TYPE(addresses = rb_hash_aref(glue, name)) == T_NIL)
+      rb_hash_aset(glue, name, addresses = rb_ary_new());
+    rb_ary_push(addresses, rb_str_new2((char *)dns_ntop(rr->glue[i].family, &(rr->glue[i].addr), ip, INET6_ADDRSTRLEN)));
+  }
+  srv_glue_free(rr);
+
+  rb_funcall(query, method_do_success, 1, rb_assoc_new(array, glue));
+}
+
+
+/* udns callbacks. */
+
+static void dns_result_A_cb(struct dns_ctx *dns_context, struct dns_rr_a4 *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_A, rr, data);
+}
+
+
+static void dns_result_AAAA_cb(struct dns_ctx *dns_context, struct dns_rr_a6 *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_AAAA, rr, data);
+}
+
+
+static void dns_result_PTR_cb(struct dns_ctx *dns_context, struct dns_rr_ptr *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_PTR, rr, data);
+}
+
+
+static void dns_result_MX_cb(struct dns_ctx *dns_context, struct dns_rr_mx *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_MX, rr, data);
+}
+
+
+static void dns_result_NS_cb(struct dns_ctx *dns_context, struct dns_rr_ns *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_NS, rr, data);
+}
+
+
+static void dns_result_TXT_cb(struct dns_ctx *dns_context, struct dns_rr_txt *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_TXT, rr, data);
+}
+
+
+static void dns_result_SRV_cb(struct dns_ctx *dns_context, struct dns_rr_srv *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_SRV, rr, data);
+}
+
+
+static void dns_result_NAPTR_cb(struct dns_ctx *dns_context, struct dns_rr_naptr *rr, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_NAPTR, rr, data);
+}
+
+
+static void dns_result_SRV_glue_cb(struct dns_ctx *dns_context, void *result, void *data)
+{
+  dispatch_result(dns_context, (result_fn)result_SRV_glue, result, data);
+}
+
 VALUE get_dns_error(struct dns_ctx *dns_context)
 {
   switch(dns_status(dns_context)) {
@@ -408,12 +974,13 @@ VALUE Resolver_submit_A(VALUE self, VALUE rb_domain)
   struct resolver_query *data;
 
   
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(rb_domain);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
   
   if (!dns_submit_a4(dns_context, domain, 0, dns_result_A_cb, (void *)data)) {
@@ -437,12 +1004,13 @@ VALUE Resolver_submit_AAAA(VALUE self, VALUE rb_domain)
   VALUE error;
   struct resolver_query *data;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(rb_domain);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
 
   if (!dns_submit_a6(dns_context, domain, 0, dns_result_AAAA_cb, (void *)data)) {
@@ -468,12 +1036,13 @@ VALUE Resolver_submit_PTR(VALUE self, VALUE rb_ip)
   struct in_addr addr;
   struct in6_addr addr6;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   ip = StringValueCStr(rb_ip);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
 
   switch(dns_pton(AF_INET, ip, &addr)) {
@@ -523,12 +1092,13 @@ VALUE Resolver_submit_MX(VALUE self, VALUE rb_domain)
   VALUE error;
   struct resolver_query *data;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(rb_domain);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
 
   if (!dns_submit_mx(dns_context, domain, 0, dns_result_MX_cb, (void *)data)) {
@@ -551,12 +1121,13 @@ VALUE Resolver_submit_NS(VALUE self, VALUE rb_domain)
   VALUE error;
   struct resolver_query *data;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(rb_domain);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data-> query = query;
 
   if (!dns_submit_ns(dns_context, domain, 0, dns_result_NS_cb, (void *)data)) {
@@ -579,12 +1150,13 @@ VALUE Resolver_submit_TXT(VALUE self, VALUE rb_domain)
   VALUE error;
   struct resolver_query *data;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(rb_domain);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
 
   if (!dns_submit_txt(dns_context, domain, DNS_C_IN, 0, dns_result_TXT_cb, (void *)data)) {
@@ -621,12 +1193,13 @@ VALUE Resolver_submit_SRV(int argc, VALUE *argv, VALUE self)
   else
     rb_raise(rb_eArgError, "arguments must be `domain' or `domain',`service',`protocol'");
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(argv[0]);
   query = rb_obj_alloc(cQuery);
   
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
   
   if (!dns_submit_srv(dns_context, domain, service, protocol, 0, dns_result_SRV_cb, (void *)data)) {
@@ -642,6 +1215,37 @@ VALUE Resolver_submit_SRV(int argc, VALUE *argv, VALUE self)
 }
 
 
+VALUE Resolver_submit_SRV_glue(VALUE self, VALUE rb_domain)
+{
+  struct dns_ctx *dns_context;
+  char *domain;
+  VALUE query;
+  VALUE error;
+  struct resolver_query *data;
+
+  dns_context = get_dns_context(self);
+  domain = StringValueCStr(rb_domain);
+  query = rb_obj_alloc(cQuery);
+
+  data = ALLOC(struct resolver_query);
+  data->resolver = self;
+  data->owner = get_resolver(self);
+  data->query = query;
+
+  /* Names given by resolve_service are already fully qualified. */
+  if (!dns_submit_p(dns_context, domain, DNS_C_IN, DNS_T_SRV, DNS_NOSRCH, dns_parse_srv_glue, dns_result_SRV_glue_cb, (void *)data)) {
+    error = get_dns_error(dns_context);
+    xfree(data);
+    rb_funcall(query, method_do_error, 1, error);
+  }
+  else {
+    rb_hash_aset(rb_ivar_get(self, id_queries), query, Qtrue);
+  }
+
+  return query;
+}
+
+
 VALUE Resolver_submit_NAPTR(VALUE self, VALUE rb_domain)
 {
   struct dns_ctx *dns_context;
@@ -650,12 +1254,13 @@ VALUE Resolver_submit_NAPTR(VALUE self, VALUE rb_domain)
   VALUE error;
   struct resolver_query *data;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   domain = StringValueCStr(rb_domain);
   query = rb_obj_alloc(cQuery);
 
   data = ALLOC(struct resolver_query);
   data->resolver = self;
+  data->owner = get_resolver(self);
   data->query = query;
 
   if (!dns_submit_naptr(dns_context, domain, 0, dns_result_NAPTR_cb, (void *)data)) {
@@ -684,7 +1289,7 @@ VALUE Resolver_add_serv(VALUE self, VALUE ip)
   struct dns_ctx *dns_context;
   struct servent *sp;
 
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
 
   if (TYPE(ip) == T_NIL) {
     return INT2FIX(dns_add_serv(dns_context, NULL));
@@ -697,10 +1302,47 @@ VALUE Resolver_add_serv(VALUE self, VALUE ip)
 VALUE Resolver_add_serv_s(VALUE self, VALUE ip, VALUE port)
 {
   struct dns_ctx *dns_context;
-  Data_Get_Struct(self, struct dns_ctx, dns_context);
+  dns_context = get_dns_context(self);
   return INT2FIX(_add_serv_s(dns_context, StringValueCStr(ip), FIX2INT(port)));
 }
 
+VALUE Resolver_add_srch(VALUE self, VALUE domain)
+{
+  struct dns_ctx *dns_context;
+  dns_context = get_dns_context(self);
+
+  /* nil clears the search list. */
+  if (TYPE(domain) == T_NIL)
+    return INT2FIX(dns_add_srch(dns_context, NULL));
+
+  return INT2FIX(dns_add_srch(dns_context, StringValueCStr(domain)));
+}
+
+/* A negative ndots just returns the current value. */
+VALUE Resolver_set_ndots(VALUE self, VALUE ndots)
+{
+  struct dns_ctx *dns_context;
+  dns_context = get_dns_context(self);
+  return INT2FIX(dns_set_opt(dns_context, DNS_OPT_NDOTS, FIX2INT(ndots)));
+}
+
+/* Search list used by udns (from resolv.conf, the environment, the local
+ * domain name or add_srch). */
+VALUE Resolver_search_domains(VALUE self)
+{
+  dnscc_t *dn;
+  char domain[DNS_MAXNAME];
+  VALUE array;
+
+  array = rb_ary_new();
+  for(dn = dns_get_srch(get_dns_context(self)); *dn; dn += dns_dnlen(dn)) {
+    dns_dntop(dn, domain, DNS_MAXNAME);
+    rb_ary_push(array, rb_str_new2(domain));
+  }
+
+  return array;
+}
+
 /* Attribute readers. */
 VALUE RR_MX_domain(VALUE self)          { return rb_ivar_get(self, id_domain); }
 VALUE RR_MX_priority(VALUE self)        { return rb_ivar_get(self, id_priority); }
@@ -723,25 +1365,40 @@ void Init_em_udns_ext()
   mEm = rb_define_module("EventMachine");
   mUdns = rb_define_module_under(mEm, "Udns");
   eUdnsError = rb_define_class_under(mUdns, "UdnsError", rb_eStandardError);
+  rb_define_private_method(rb_singleton_class(mUdns), "dns_init", Udns_dns_init, 0);
 
   cResolver = rb_define_class_under(mUdns, "Resolver", rb_cObject);
   rb_define_alloc_func(cResolver, Resolver_alloc);
   rb_define_private_method(cResolver, "dns_open", Resolver_dns_open, 0);
+  rb_define_private_method(cResolver, "dns_renew", Resolver_dns_renew, 0);
+  rb_define_private_method(cResolver, "draining_fds", Resolver_draining_fds, 0);
+  rb_define_private_method(cResolver, "drained_fds", Resolver_drained_fds, 0);
+  rb_define_private_method(cResolver, "free_drained", Resolver_free_drained, 0);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_define_private_method(cResolver, "native_loop", Resolver_native_loop, 0);
+#endif
+  rb_define_private_method(cResolver, "drop_pending", Resolver_drop_pending, 0);
+  rb_define_private_method(cResolver, "native_wakeup", Resolver_native_wakeup, 0);
+  rb_define_private_method(cResolver, "native_stop", Resolver_native_stop, 0);
   rb_define_method(cResolver, "fd", Resolver_fd, 0);
-  rb_define_method(cResolver, "ioevent", Resolver_ioevent, 0);
+  rb_define_private_method(cResolver, "dns_ioevent", Resolver_ioevent, 0);
   rb_define_private_method(cResolver, "timeouts", Resolver_timeouts, 0);
   rb_define_method(cResolver, "active", Resolver_active, 0);
-  rb_define_method(cResolver, "cancel", Resolver_cancel, 1);
-  rb_define_method(cResolver, "submit_A", Resolver_submit_A, 1);
-  rb_define_method(cResolver, "submit_AAAA", Resolver_submit_AAAA, 1);
-  rb_define_method(cResolver, "submit_PTR", Resolver_submit_PTR, 1);
-  rb_define_method(cResolver, "submit_MX", Resolver_submit_MX, 1);
-  rb_define_method(cResolver, "submit_TXT", Resolver_submit_TXT, 1);
-  rb_define_method(cResolver, "submit_SRV", Resolver_submit_SRV, -1);
-  rb_define_method(cResolver, "submit_NAPTR", Resolver_submit_NAPTR, 1);
-  rb_define_method(cResolver, "submit_NS", Resolver_submit_NS, 1);
+  rb_define_private_method(cResolver, "dns_cancel", Resolver_cancel, 1);
+  rb_define_private_method(cResolver, "dns_submit_A", Resolver_submit_A, 1);
+  rb_define_private_method(cResolver, "dns_submit_AAAA", Resolver_submit_AAAA, 1);
+  rb_define_private_method(cResolver, "dns_submit_PTR", Resolver_submit_PTR, 1);
+  rb_define_private_method(cResolver, "dns_submit_MX", Resolver_submit_MX, 1);
+  rb_define_private_method(cResolver, "dns_submit_TXT", Resolver_submit_TXT, 1);
+  rb_define_private_method(cResolver, "dns_submit_SRV", Resolver_submit_SRV, -1);
+  rb_define_private_method(cResolver, "dns_submit_SRV_glue", Resolver_submit_SRV_glue, 1);
+  rb_define_private_method(cResolver, "dns_submit_NAPTR", Resolver_submit_NAPTR, 1);
+  rb_define_private_method(cResolver, "dns_submit_NS", Resolver_submit_NS, 1);
   rb_define_method(cResolver, "add_serv", Resolver_add_serv, 1);
   rb_define_method(cResolver, "add_serv_s", Resolver_add_serv_s, 2);
+  rb_define_private_method(cResolver, "add_srch", Resolver_add_srch, 1);
+  rb_define_private_method(cResolver, "set_ndots", Resolver_set_ndots, 1);
+  rb_define_private_method(cResolver, "search_domains", Resolver_search_domains, 0);
 
   cQuery = rb_define_class_under(mUdns, "Query", rb_cObject);
 
@@ -775,6 +1432,7 @@ void Init_em_udns_ext()
   id_service = rb_intern("@service");
   id_regexp = rb_intern("@regexp");
   id_replacement = rb_intern("@replacement");
+  id_ttl = rb_intern("@ttl");
 
   symbol_dns_error_tempfail = ID2SYM(rb_intern("dns_error_tempfail"));
   symbol_dns_error_protocol = ID2SYM(rb_intern("dns_error_protocol"));
@@ -789,4 +1447,5 @@ void Init_em_udns_ext()
   method_set_timer = rb_intern("set_timer");
   method_do_success = rb_intern("do_success");
   method_do_error = rb_intern("do_error");
+  method_native_drain = rb_intern("native_drain");
 }
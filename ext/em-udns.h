@@ -2,9 +2,52 @@
 #define em_udns_h
 
 
+typedef void (*result_fn)(int status, void *rr, void *data);
+
+/* A result received while the GVL is released, converted later. */
+struct pending_result {
+  result_fn              fn;
+  int                    status;
+  void                   *rr;
+  void                   *data;
+  struct pending_result  *next;
+};
+
+struct resolver {
+  struct dns_ctx         *context;    /* Context where new queries are submitted. */
+  struct dns_ctx         **draining;  /* Previous contexts (before reloading) with pending queries. */
+  int                    ndraining;
+  /* Native loop mode. */
+  int                    native;
+  volatile int           stop;
+  int                    wake[2];     /* Pipe to interrupt poll(). */
+  int                    timer_ms;    /* Time until the next Ruby timer (-1 if none). */
+  struct pending_result  *pending_head;
+  struct pending_result  *pending_tail;
+};
+
 struct resolver_query {
-  VALUE    resolver;
-  VALUE    query;
+  VALUE            resolver;
+  VALUE            query;
+  struct resolver  *owner;
+};
+
+/* An A or AAAA record found in the additional section of a SRV response. */
+struct srv_glue {
+  char     name[DNS_MAXNAME];
+  int      family;
+  union {
+    struct in_addr   addr4;
+    struct in6_addr  addr6;
+  } addr;
+};
+
+/* Result of dns_parse_srv_glue(). The SRV records and the glue array are
+ * allocated separately so srv_glue_free() must be used. */
+struct srv_glue_result {
+  struct dns_rr_srv  *srv;
+  int                nglue;
+  struct srv_glue    *glue;
 };
 
 
@@ -70,4 +70,9 @@ Dir.chdir(here) do
 end
 
 have_library("udns")  # == -ludns
+
+# Native loop mode releases the GVL while waiting for responses (Ruby >= 2.0).
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+
 create_makefile("em-udns/em_udns_ext")
@@ -1,7 +1,13 @@
+require "thread"
 require "eventmachine"
 
 require "em-udns/em_udns_ext"
 require "em-udns/version"
+require "em-udns/cache"
+require "em-udns/hosts"
+require "em-udns/search_list"
+require "em-udns/service"
+require "em-udns/throttle"
 require "em-udns/resolver"
 require "em-udns/query"
 
@@ -18,6 +24,25 @@ module EventMachine::Udns
     end
   end
 
+  module ResolvConfWatcher
+    def initialize(resolver)
+      @resolver = resolver
+    end
+
+    def file_modified
+      @resolver.send(:resolv_conf_changed, false)
+    end
+
+    def file_moved
+      stop_watching
+      @resolver.send(:resolv_conf_changed, true)
+    end
+
+    def file_deleted
+      @resolver.send(:resolv_conf_changed, true)
+    end
+  end
+
   def self.nameservers=(nameservers)
     if nameservers
       ENV.delete("NAMESERVERS")
@@ -31,6 +56,8 @@ module EventMachine::Udns
         else
           raise Error, "`nameservers' argument must be a String or Array of addresses"
         end
+      # The system configuration is read just once, so read it again.
+      dns_init
     end
   end
   
@@ -40,9 +67,20 @@ module EventMachine::Udns
     raise Error, "`resolver' argument must be a EM::Udns::Resolver instance" unless
       resolver.is_a? EM::Udns::Resolver
 
-    EM.watch resolver.fd, Watcher, resolver do |dns_client|
-      dns_client.notify_readable = true
-    end
+    resolver.send(:watch)
+
+    self
+  end
+
+  # Runs the resolver without EventMachine: a native thread polls its
+  # socket and processes the responses releasing the GVL, so any thread can
+  # submit queries and wait for their results. The :on_error option is a
+  # Proc invoked with the exceptions raised by callbacks in that thread.
+  def self.run_native(resolver, options = {})
+    raise ArgumentError, "`resolver' argument must be a EM::Udns::Resolver instance" unless
+      resolver.is_a? EM::Udns::Resolver
+
+    resolver.send(:run_native, options[:on_error])
 
     self
   end
@@ -0,0 +1,93 @@
+module EventMachine::Udns
+
+  # Answer cache used by EM::Udns::Resolver when the :cache option is given.
+  #
+  # Entries are kept in insertion order (least recently used first) so the
+  # oldest one is evicted when :max_entries is reached. A fresh entry which
+  # has been hit at least :prefetch_hits times and enters the last :prefetch
+  # fraction of its TTL is reported as needing a refresh, so the resolver can
+  # re-query it before it expires. Expired entries are retained during
+  # :serve_stale seconds so they can be returned if the nameserver fails
+  # (RFC 8767).
+  class Cache
+    Entry = Struct.new(:result, :ttl, :expires_at, :hits, :prefetching)
+
+    DEFAULT_MAX_ENTRIES = 10000
+    DEFAULT_PREFETCH = 0.1
+    DEFAULT_PREFETCH_HITS = 3
+    DEFAULT_SERVE_STALE = 0
+
+    attr_reader :max_entries, :prefetch, :prefetch_hits, :serve_stale
+
+    def initialize(options = {})
+      @max_entries = options[:max_entries] || DEFAULT_MAX_ENTRIES
+      @prefetch = options[:prefetch] || DEFAULT_PREFETCH
+      @prefetch_hits = options[:prefetch_hits] || DEFAULT_PREFETCH_HITS
+      @serve_stale = options[:serve_stale] || DEFAULT_SERVE_STALE
+      @entries = {}
+    end
+
+    def size
+      @entries.size
+    end
+
+    def clear
+      @entries.clear
+    end
+
+    # Returns nil on miss (or expired entry), otherwise a two elements Array
+    # with the cached result and a boolean telling whether the entry should
+    # be prefetched now. Returning true marks the entry as being prefetched.
+    def lookup(key, now = Time.now)
+      return nil unless entry = @entries[key]
+      if now >= entry.expires_at
+        drop(key, entry, now)
+        return nil
+      end
+
+      # Move to the most recently used position.
+      @entries.delete(key)
+      @entries[key] = entry
+      entry.hits += 1
+
+      refresh = !entry.prefetching && @prefetch > 0 && entry.hits >= @prefetch_hits &&
+                (entry.expires_at - now) <= entry.ttl * @prefetch
+      entry.prefetching = true if refresh
+      [entry.result, refresh]
+    end
+
+    def store(key, result, ttl, now = Time.now)
+      return if ttl.nil? || ttl <= 0
+      hits = (entry = @entries.delete(key)) ? entry.hits : 0
+      @entries.shift while @entries.size >= @max_entries && @entries.any?
+      @entries[key] = Entry.new(result, ttl, now + ttl, hits, false)
+    end
+
+    # Called when a prefetch query fails so a later hit can retry it.
+    def prefetch_failed(key)
+      entry = @entries[key] and entry.prefetching = false
+    end
+
+    # Returns the last known result for the key if it expired less than
+    # :serve_stale seconds ago, nil otherwise.
+    def stale(key, now = Time.now)
+      return nil unless @serve_stale > 0 && (entry = @entries[key])
+      return nil if drop(key, entry, now)
+      entry.result
+    end
+
+
+    private
+
+    # Removes the entry if it's not usable as stale answer anymore.
+    def drop(key, entry, now)
+      if now >= entry.expires_at + @serve_stale
+        @entries.delete(key)
+        true
+      else
+        false
+      end
+    end
+  end
+
+end
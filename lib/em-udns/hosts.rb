@@ -0,0 +1,131 @@
+require "ipaddr"
+
+
+module EventMachine::Udns
+
+  # Static table of A, AAAA, PTR and SRV records consulted by
+  # EM::Udns::Resolver before querying the nameservers.
+  #
+  # Records are stored in a Hash keyed by normalized name (lowercase and
+  # without trailing dot) and, for PTR records, by normalized IP address.
+  # The table is never modified once built so a resolver can swap it
+  # atomically by assigning a new one.
+  class Hosts
+    DEFAULT_FILE = "/etc/hosts"
+
+    # Parses a hosts(5) format file.
+    def self.load(path = DEFAULT_FILE)
+      hosts = new
+      File.foreach(path) do |line|
+        ip, *names = line.sub(/#.*/, "").split
+        next unless ip && names.any?
+        begin
+          hosts.add_address(ip, names)
+        rescue ArgumentError
+          # Ignore lines with invalid addresses, as the system resolver does.
+        end
+      end
+      hosts
+    end
+
+    # Builds the table from a Hash whose keys are domain names and whose
+    # values are either IP addresses (a String or Array of them) or a Hash
+    # of record type => Array of records, such as:
+    #
+    #   { "db.local" => ["10.0.0.1", "fd00::1"],
+    #     "_sip._udp.example.net" => { "SRV" => [[10, 50, 5060, "sip.example.net"]] } }
+    def self.from_hash(hash)
+      hosts = new
+      hash.each do |name, value|
+        case value
+        when String, Array
+          [*value].each { |ip| hosts.add_address(ip, [name]) }
+        when Hash
+          value.each do |type, records|
+            case type.to_s.upcase
+            when "A", "AAAA"
+              [*records].each { |ip| hosts.add_address(ip, [name]) }
+            when "PTR"
+              [*records].each { |ip| hosts.add_address(ip, [name], false) }
+            when "SRV"
+              records.each { |srv| hosts.add_srv(name, *srv) }
+            else
+              raise ArgumentError, "unsupported static record type #{type.inspect}"
+            end
+          end
+        else
+          raise ArgumentError, "invalid static record for #{name.inspect}"
+        end
+      end
+      hosts
+    end
+
+    def self.normalize_name(name)
+      name.downcase.chomp(".")
+    end
+
+    def initialize
+      @records = {}
+    end
+
+    def empty?
+      @records.empty?
+    end
+
+    # Adds the IP address to the given names. The first name is the
+    # canonical one, returned by PTR lookups on the address.
+    def add_address(ip, names, forward = true)
+      addr = IPAddr.new(ip)
+      if forward
+        type = addr.ipv4? ? "A" : "AAAA"
+        names.each { |name| add(Hosts.normalize_name(name), type, addr.to_s) }
+      end
+      add(addr.to_s, "PTR", Hosts.normalize_name(names.first))
+      self
+    end
+
+    def add_srv(name, priority, weight, port, domain)
+      rr_srv = RR_SRV.allocate
+      rr_srv.instance_variable_set(:@domain, Hosts.normalize_name(domain))
+      rr_srv.instance_variable_set(:@priority, priority.to_i)
+      rr_srv.instance_variable_set(:@weight, weight.to_i)
+      rr_srv.instance_variable_set(:@port, port.to_i)
+      add(Hosts.normalize_name(name), "SRV", rr_srv)
+      self
+    end
+
+    # Returns an Array with the records of the given type for the arguments
+    # given to Resolver#submit_XXX, or nil if there are none.
+    def lookup(type, args)
+      key = case type
+        when "A", "AAAA"
+          Hosts.normalize_name(args[0])
+        when "PTR"
+          begin
+            IPAddr.new(args[0]).to_s
+          rescue ArgumentError
+            return nil
+          end
+        when "SRV"
+          if args[1] && args[2]
+            Hosts.normalize_name("_#{args[1]}._#{args[2]}.#{args[0]}")
+          else
+            Hosts.normalize_name(args[0])
+          end
+        else
+          return nil
+        end
+
+      (records = @records[key]) && records[type]
+    end
+
+
+    private
+
+    def add(key, type, record)
+      records = (@records[key] ||= {})[type] ||= []
+      records << record unless records.include?(record)
+    end
+  end
+
+end
@@ -1,24 +1,122 @@
 module EventMachine::Udns
 
   class Query
+    # TTL (in seconds) of the received answer, nil if not received from the wire.
+    attr_reader :ttl
+
     def callback &block
       @on_success_block = block
     end
 
+    # If the query already failed when submitted (so before the errback was
+    # set) the block is invoked right now.
     def errback &block
       @on_error_block = block
+      if @submit_error
+        error, @submit_error = @submit_error, nil
+        block.call(error)
+      end
+    end
+
+    # Whether the result is an expired cached answer delivered because the
+    # nameserver failed.
+    def stale?
+      @stale ? true : false
     end
 
 
     private
 
     def do_success result
+      @resolver.send(:cache_store, @cache_key, result, @ttl) if @cache_key
       @on_success_block && @on_success_block.call(result)
     end
 
     def do_error error
-      @on_error_block && @on_error_block.call(error)
+      if @cache_key and result = @resolver.send(:cache_stale, @cache_key, error)
+        @stale = true
+        return @on_success_block && @on_success_block.call(result)
+      end
+      if @on_error_block
+        @on_error_block.call(error)
+      else
+        @submit_error = error
+      end
+    end
+  end
+
+
+  # Query returned to other threads by a resolver running its native loop
+  # (see EM::Udns.run_native). The callback and errback are invoked in the
+  # loop thread, or right away if the query already finished.
+  class NativeQuery < Query
+    def initialize
+      @mutex = Mutex.new
+      @finished = ConditionVariable.new
+      @done = false
+      @cancelled = false
+    end
+
+    def callback &block
+      done = @mutex.synchronize do
+        @on_success_block = block
+        @done && !@error
+      end
+      block.call(@result) if done
+    end
+
+    def errback &block
+      done = @mutex.synchronize do
+        @on_error_block = block
+        @done && @error
+      end
+      block.call(@error) if done
+    end
+
+    # Blocks the calling thread until the query finishes or the timeout (in
+    # seconds) expires. Returns the result, the error Symbol, or nil if it
+    # timed out or the query was cancelled.
+    def wait(timeout = nil)
+      deadline = Time.now + timeout if timeout
+      @mutex.synchronize do
+        until @done || @cancelled
+          if deadline
+            break if (remaining = deadline - Time.now) <= 0
+            @finished.wait(@mutex, remaining)
+          else
+            @finished.wait(@mutex)
+          end
+        end
+        @done ? (@error || @result) : nil
+      end
+    end
+
+    def cancelled?
+      @cancelled
+    end
+
+
+    private
+
+    def cancel!
+      @mutex.synchronize do
+        return false if @done || @cancelled
+        @cancelled = true
+        @finished.broadcast
+      end
+      true
+    end
+
+    def finish result, error, ttl, stale
+      block = @mutex.synchronize do
+        return if @done || @cancelled
+        @done = true
+        @result, @error, @ttl, @stale = result, error, ttl, stale
+        @finished.broadcast
+        error ? @on_error_block : @on_success_block
+      end
+      block.call(error || result) if block
     end
   end
 
-end
\ No newline at end of file
+end
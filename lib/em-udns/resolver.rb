@@ -1,9 +1,294 @@
 module EventMachine::Udns
 
   class Resolver
+    RR_TYPES = %w{A AAAA PTR MX TXT SRV NAPTR NS}
+
+    # Errors for which a stale cached answer is delivered instead.
+    STALE_ERRORS = [:dns_error_tempfail, :dns_error_protocol]
+
+    # Errors for which the next search list expansion is tried.
+    SEARCH_ERRORS = [:dns_error_nxdomain, :dns_error_nodata]
+
+    attr_reader :cache
+    attr_reader :hosts
+    attr_reader :search_list
+    attr_reader :throttle
+
     def initialize(options = {})
       raise UdnsError, @alloc_error if @alloc_error
       @queries = {}
+      @watchers = {}
+      @options = options
+      case cache = options[:cache]
+      when Cache
+        @cache = cache
+      when Hash
+        @cache = Cache.new(cache)
+      when true
+        @cache = Cache.new
+      end
+      self.hosts = options[:hosts]
+      if options[:max_inflight] || options[:qps]
+        @throttle = Throttle.new(options)
+      end
+      configure
+      dns_open
+    end
+
+    # Re-reads /etc/resolv.conf and applies the nameservers and search list
+    # (options given to new can be overridden) to the following queries.
+    # Pending queries go on using the previous configuration and socket
+    # until they finish.
+    def reload(options = {})
+      if foreign_thread?
+        native_call { reload(options) }
+        return self
+      end
+      current = @options
+      # :nameserver and :nameservers are the same setting.
+      if options.key?(:nameserver) || options.key?(:nameservers)
+        current = current.reject { |key, value| key == :nameserver || key == :nameservers }
+      end
+      @options = current.merge(options)
+      EM::Udns.send(:dns_init)
+      dns_renew
+      configure
+      dns_open
+      if @watchers.empty?
+        reap_drained
+      else
+        watch
+      end
+      self
+    end
+
+    # Replaces the static records table. It can be given as a
+    # EM::Udns::Hosts instance, a Hash (see Hosts.from_hash), the path of a
+    # hosts format file, true (for /etc/hosts) or nil (to disable it).
+    def hosts=(hosts)
+      @hosts = case hosts
+        when Hosts, nil
+          hosts
+        when Hash
+          Hosts.from_hash(hosts)
+        when String
+          Hosts.load(hosts)
+        when true
+          Hosts.load
+        else
+          raise ArgumentError, "`hosts' must be a EM::Udns::Hosts, Hash, String or true"
+        end
+    end
+
+    # submit_XXX methods accept an optional trailing Hash with a :priority
+    # (:high, :normal or :low) used when the queries are throttled.
+    RR_TYPES.each do |type|
+      define_method("submit_#{type}") do |*args|
+        raise UdnsError, "the native loop is stopped" if @native == :stopped
+        return submit(type, *args) unless foreign_thread?
+        check_arguments(type, args)
+        native_submit { submit(type, *args) }
+      end
+    end
+
+    # Cancels the query so no callback/errback will be called.
+    def cancel(query)
+      if query.is_a?(NativeQuery)
+        @native_mutex.synchronize { @native_queries.delete(query) }
+        return query.send(:cancel!)
+      end
+      dns_cancel(query)
+    end
+
+    # Stops the native loop (see EM::Udns.run_native). Pending queries
+    # submitted by other threads are cancelled (so NativeQuery#wait returns
+    # nil) and following submissions raise UdnsError until it's run again.
+    def stop
+      return unless @native == true
+      @native_stopping = true
+      native_stop
+      if Thread.current == @native_thread
+        native_stopped
+      else
+        begin
+          @native_thread.join
+        rescue StandardError
+          # Raised by a callback, the thread already reported it.
+        end
+      end
+      nil
+    end
+
+    def ioevent
+      dns_ioevent
+      reap_drained if @reload_timer
+      drain_queue if @throttle
+      nil
+    end
+
+    # Number of queries waiting to be sent per priority.
+    def queue_depth
+      @throttle ? @throttle.depth : {}
+    end
+
+    # Queue metrics per priority (see EM::Udns::Throttle#stats).
+    def queue_stats
+      @throttle ? @throttle.stats : {}
+    end
+
+    # Resolves the domain into an ordered Array of EM::Udns::ServiceTarget
+    # following RFC 3263 (see EM::Udns::Service for the options).
+    def resolve_service(domain, options = {})
+      raise UdnsError, "the native loop is stopped" if @native == :stopped
+      raise TypeError, "can't convert #{domain.class} into String" unless domain.respond_to?(:to_str)
+      domain = domain.to_str
+      Throttle.check_priority(options[:priority] || Throttle::DEFAULT_PRIORITY)
+      return native_submit { resolve_service(domain, options) } if foreign_thread?
+      query = Query.new
+      @queries[query] = true
+      Service.new(self, query, domain, options).run
+      query
+    end
+
+
+    private
+
+    # Starts the native loop thread (called by EM::Udns.run_native). An
+    # exception raised by a callback is passed to on_error and the loop goes
+    # on, or it stops the loop if there is no on_error.
+    def run_native(on_error = nil)
+      raise NotImplementedError, "native loop mode requires rb_thread_call_without_gvl (Ruby >= 2.0)" unless
+        respond_to?(:native_loop, true)
+      raise UdnsError, "the native loop is already running" if @native == true
+      raise UdnsError, "the resolver is already run by EventMachine" unless @watchers.empty?
+
+      @native_queue = Queue.new
+      @native_timers = []
+      @native_queries = {}
+      @native_mutex = Mutex.new
+      @native_stopping = false
+      @native = true
+      @native_thread = Thread.new do
+        @native_thread = Thread.current
+        begin
+          native_loop
+        rescue => e
+          raise unless on_error
+          on_error.call(e)
+          retry unless @native_stopping
+        ensure
+          native_stopped
+        end
+      end
+    end
+
+    # Cancels the queries submitted by other threads which didn't finish,
+    # and drops the responses received but not delivered yet.
+    def native_stopped
+      drop_pending
+      queries = @native_mutex.synchronize do
+        @native = :stopped
+        queries, @native_queries = @native_queries.keys, {}
+        queries
+      end
+      queries.each { |query| query.send(:cancel!) }
+    end
+
+    def foreign_thread?
+      @native == true && Thread.current != @native_thread
+    end
+
+    # Runs the block in the loop thread.
+    def native_call(&block)
+      @native_queue << block
+      native_wakeup
+    end
+
+    # Raises the errors that submit_XXX would raise for invalid arguments,
+    # so in native mode they are raised in the calling thread rather than in
+    # the loop thread.
+    def check_arguments(type, args)
+      args = args.dup
+      Throttle.check_priority((args.pop[:priority] if args.last.is_a?(Hash)) || Throttle::DEFAULT_PRIORITY)
+      if type == "SRV"
+        unless (args.size == 1 && args[0].is_a?(String)) ||
+               (args.size == 3 && args[0].is_a?(String) &&
+                (args[1..2].all? { |arg| arg.is_a?(String) } || args[1..2].all? { |arg| arg.nil? }))
+          raise ArgumentError, "arguments must be `domain' or `domain',`service',`protocol'"
+        end
+      elsif args.size != 1
+        raise ArgumentError, "wrong number of arguments (#{args.size} for 1)"
+      end
+      # SRV service and protocol can be nil.
+      (type == "SRV" ? args.compact : args).each do |arg|
+        raise TypeError, "can't convert #{arg.class} into String" unless arg.respond_to?(:to_str)
+        raise ArgumentError, "string contains null byte" if arg.to_str.include?("\0")
+      end
+    end
+
+    # Performs the submission in the loop thread and returns a NativeQuery
+    # which gets its result.
+    def native_submit(&submission)
+      query = NativeQuery.new
+      @native_mutex.synchronize do
+        raise UdnsError, "the native loop is stopped" unless @native == true
+        @native_queries[query] = true
+      end
+      native_call do
+        unless query.cancelled?
+          begin
+            sent = submission.call
+          rescue
+            cancel(query)
+            raise
+          end
+          sent.callback { |result| native_finish(query, result, nil, sent.ttl, sent.stale?) }
+          sent.errback { |error| native_finish(query, nil, error, nil, false) }
+        end
+      end
+      query
+    end
+
+    def native_finish(query, result, error, ttl, stale)
+      @native_mutex.synchronize { @native_queries.delete(query) }
+      query.send(:finish, result, error, ttl, stale)
+    end
+
+    # Called by the native loop (with the GVL) before waiting for responses.
+    # Returns the milliseconds until the next timer (-1 if none).
+    def native_drain
+      @native_queue.pop.call until @native_queue.empty?
+      unless @native_timers.empty?
+        now = Time.now
+        due, @native_timers = @native_timers.partition { |at, block| at <= now }
+        due.each { |at, block| block.call }
+      end
+      drain_queue if @throttle
+      return 0 unless @native_queue.empty?
+      return -1 if @native_timers.empty?
+      [((@native_timers.map { |at, block| at }.min - Time.now) * 1000).ceil, 0].max
+    end
+
+    # Runs the block after the delay (in seconds), in the next reactor tick
+    # (or loop iteration in native mode) if it's zero.
+    def later(delay = 0, &block)
+      if @native
+        if delay.zero?
+          @native_queue << block
+        else
+          @native_timers << [Time.now + delay, block]
+        end
+      elsif delay.zero?
+        EM.next_tick(&block)
+      else
+        EM::Timer.new(delay, &block)
+      end
+    end
+
+    # Applies the nameservers, search list and ndots options to the context
+    # (before opening it).
+    def configure
+      options = @options
       nameservers = [*options[:nameserver]] + [*options[:nameservers]]
       if nameservers.any?
         add_serv(nil) # clear the list initialized from /etc/resolv.conf
@@ -16,14 +301,269 @@ module EventMachine::Udns
           end
         end
       end
-      dns_open
+      search = options[:search]
+      if search == false
+        add_srch(nil) # don't use the search list at all
+      elsif search
+        add_srch(nil) # clear the list initialized from /etc/resolv.conf
+        [*search].each { |domain| add_srch(domain) }
+      end
+      set_ndots(options[:ndots]) if options[:ndots]
+      @search_list = nil
+      if options[:parallel_search] && search != false
+        # The same search list and ndots udns uses for sequential search.
+        @search_list = SearchList.new(search_domains, set_ndots(-1))
+      end
     end
 
+    # Attaches the socket to EventMachine (called by EM::Udns.run), and
+    # those of the previous configurations with pending queries.
+    def watch
+      [fd, *draining_fds].each do |fd|
+        @watchers[fd] ||= EM.watch(fd, Watcher, self) do |dns_client|
+          dns_client.notify_readable = true
+        end
+      end
+      reap_drained
+      watch_resolv_conf if @options[:watch_resolv_conf] && !@resolv_conf_watcher
+    end
 
-    private
+    # Reloads when /etc/resolv.conf changes (using inotify on Linux). As the
+    # file is usually replaced rather than modified, the watch is set again.
+    def watch_resolv_conf(reload_after = false)
+      begin
+        @resolv_conf_watcher = EM.watch_file(SearchList::RESOLV_CONF, ResolvConfWatcher, self)
+      rescue EM::Unsupported
+        return @resolv_conf_watcher = nil
+      rescue
+        # The file is being replaced, try again later.
+        return @resolv_conf_watcher = EM::Timer.new(1) { watch_resolv_conf(true) }
+      end
+      # A reload error is raised once to the reactor. The file is still
+      # watched, so a fixed configuration is applied when written.
+      reload if reload_after
+    end
+
+    def resolv_conf_changed(replaced)
+      if replaced
+        watch_resolv_conf(true)
+      else
+        reload
+      end
+    end
+
+    # Closes the sockets of the previous configurations once their queries
+    # have finished.
+    def reap_drained
+      drained_fds.each do |fd|
+        watcher = @watchers.delete(fd) and watcher.detach
+      end
+      if free_drained.zero?
+        @reload_timer.cancel if @reload_timer
+        @reload_timer = nil
+      elsif !@reload_timer && !@watchers.empty?
+        # udns doesn't notify the timeouts of the previous configurations.
+        @reload_timer = EM::PeriodicTimer.new(1) do
+          timeouts
+          reap_drained
+        end
+      end
+    end
+
+    def submit(type, *args)
+      priority = Throttle.check_priority((args.pop[:priority] if args.last.is_a?(Hash)) || Throttle::DEFAULT_PRIORITY)
+
+      if @hosts and result = @hosts.lookup(type, args)
+        return local_query(result)
+      end
+
+      if @cache
+        key = cache_key(type, args)
+        if hit = @cache.lookup(key)
+          result, refresh = hit
+          throttled_submit(type, args, key, :low) if refresh
+          return local_query(result)
+        end
+      end
+      throttled_submit(type, args, key, priority)
+    end
+
+    # SRV query also returning the glue addresses, used by resolve_service.
+    def submit_SRV_glue(name, priority = Throttle::DEFAULT_PRIORITY)
+      if @hosts and result = @hosts.lookup("SRV", [name])
+        return local_query([result, {}])
+      end
+      throttled_submit("SRV_glue", [name], nil, Throttle.check_priority(priority))
+    end
+
+    # Sends the query, or queues it if the throttle doesn't admit it now. In
+    # that case a Query is returned and the real one is submitted later.
+    def throttled_submit(type, args, key, priority)
+      return wire_submit(type, args, key) unless @throttle
+      # A query sends a packet per search list expansion.
+      cost = (names = search_names(type, args)) ? names.size : 1
+      return wire_submit(type, args, key) if @throttle.admit?(priority, active, cost)
+
+      query = Query.new
+      query.instance_variable_set(:@resolver, self)
+      query.instance_variable_set(:@cache_key, key)
+      @queries[query] = true
+      @throttle.push(priority, [type, args, query], cost)
+      schedule_drain
+      query
+    end
+
+    def drain_queue
+      pending = lambda do |item|
+        query = item[2]
+        next true if @queries[query]
+        # Cancelled while queued.
+        @queries.delete(query)
+        false
+      end
+      while item = @throttle.shift(active, &pending)
+        type, args, query = item
+        sent = wire_submit(type, args, nil)
+        sent.callback do |result|
+          if @queries.delete(query)
+            query.instance_variable_set(:@ttl, sent.ttl)
+            query.send(:do_success, result)
+          end
+        end
+        sent.errback do |error|
+          query.send(:do_error, error) if @queries.delete(query)
+        end
+      end
+      schedule_drain
+    end
+
+    # Waits for the next token when the queue is only blocked by the qps
+    # limit (otherwise the queue is drained when a response or timeout is
+    # processed).
+    def schedule_drain
+      return if @drain_timer || !(delay = @throttle.delay)
+      @drain_timer = later(delay) do
+        @drain_timer = nil
+        drain_queue
+      end
+    end
+
+    def service_finish(query, targets, error)
+      return unless @queries.delete(query)
+      if targets
+        query.send(:do_success, targets)
+      else
+        query.send(:do_error, error)
+      end
+    end
+
+    def wire_submit(type, args, key)
+      if names = search_names(type, args)
+        search_submit(type, args, names, key)
+      else
+        query = send("dns_submit_#{type}", *args)
+        query.instance_variable_set(:@resolver, self)
+        query.instance_variable_set(:@cache_key, key)
+        query
+      end
+    end
+
+    # Returns the search list expansions of the name if they are queried at
+    # the same time, nil otherwise.
+    def search_names(type, args)
+      return nil unless @search_list && RR_TYPES.include?(type) && type != "PTR"
+      names = @search_list.expand(args[0])
+      names.size > 1 ? names : nil
+    end
+
+    # Queries all the search list expansions of the name at the same time.
+    # The query completes with the result of the first expansion (in search
+    # order) not failing with NXDOMAIN or NODATA as soon as all the previous
+    # ones have failed.
+    def search_submit(type, args, names, key)
+      query = Query.new
+      query.instance_variable_set(:@resolver, self)
+      query.instance_variable_set(:@cache_key, key)
+      @queries[query] = true
+
+      candidates = []
+      outcomes = Array.new(names.size)
+      names.each_with_index do |name, i|
+        candidate = send("dns_submit_#{type}", name, *args[1..-1])
+        candidates << candidate
+        candidate.callback { |result| outcomes[i] = [nil, result, candidate.ttl]; search_check(query, candidates, outcomes) }
+        candidate.errback { |error| outcomes[i] = [error]; search_check(query, candidates, outcomes) }
+      end
+      search_check(query, candidates, outcomes)
+      query
+    end
+
+    def search_check(query, candidates, outcomes)
+      case @queries[query]
+      when nil
+        return
+      when false
+        @queries.delete(query)
+        candidates.each { |candidate| cancel(candidate) }
+        return
+      end
+
+      error = :dns_error_nxdomain
+      result = ttl = nil
+      outcomes.each do |outcome|
+        # A higher priority expansion is still pending.
+        return unless outcome
+        if SEARCH_ERRORS.include?(outcome[0])
+          error = :dns_error_nodata if outcome[0] == :dns_error_nodata
+          next
+        end
+        error, result, ttl = outcome
+        break
+      end
+
+      @queries.delete(query)
+      candidates.each { |candidate| cancel(candidate) }
+      if error
+        query.send(:do_error, error)
+      else
+        query.instance_variable_set(:@ttl, ttl)
+        query.send(:do_success, result)
+      end
+    end
+
+    # Answers a query from the hosts table or the cache. The answer is
+    # delivered in the next reactor tick (or loop iteration) so the caller can set the callback
+    # and errback first.
+    def local_query(result)
+      query = Query.new
+      @queries[query] = true
+      later do
+        query.send(:do_success, result.dup) if @queries.delete(query)
+      end
+      query
+    end
+
+    def cache_key(type, args)
+      [type, *args.map { |arg| arg.is_a?(String) ? arg.downcase : arg }]
+    end
+
+    # Cached results are copied so callbacks modifying them don't alter the
+    # cache.
+    def cache_store(key, result, ttl)
+      @cache.store(key, result.dup, ttl)
+    end
+
+    def cache_stale(key, error)
+      @cache.prefetch_failed(key)
+      result = @cache.stale(key) if STALE_ERRORS.include?(error)
+      result && result.dup
+    end
 
     def set_timer(timeout)
-      @timer = EM::Timer.new(timeout) { timeouts }
+      @timer = EM::Timer.new(timeout) do
+        timeouts
+        drain_queue if @throttle
+      end
     end
   end
 
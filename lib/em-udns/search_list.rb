@@ -0,0 +1,31 @@
+module EventMachine::Udns
+
+  # Search domains and ndots setting used to expand relative names. The
+  # resolver takes them from its udns context, so they are those configured
+  # in resolv.conf(5) (parsed by udns) unless overridden.
+  class SearchList
+    RESOLV_CONF = "/etc/resolv.conf"
+    DEFAULT_NDOTS = 1
+
+    attr_reader :domains, :ndots
+
+    def initialize(domains, ndots = DEFAULT_NDOTS)
+      @domains = domains.map { |domain| domain.chomp(".") }.reject { |domain| domain.empty? }
+      @ndots = ndots
+    end
+
+    # Returns the absolute names (with trailing dot) to query for the given
+    # name, in the order a sequential resolver would try them.
+    def expand(name)
+      return [name] if name.end_with?(".")
+      absolute = "#{name}."
+      searched = @domains.map { |domain| "#{name}.#{domain}." }
+      if name.count(".") >= @ndots
+        [absolute, *searched]
+      else
+        searched + [absolute]
+      end
+    end
+  end
+
+end
@@ -0,0 +1,194 @@
+require "ipaddr"
+
+
+module EventMachine::Udns
+
+  # A resolved destination of Resolver#resolve_service.
+  ServiceTarget = Struct.new(:transport, :host, :port, :address)
+
+  # RFC 3263 / RFC 2782 service resolution pipeline (NAPTR -> SRV -> A/AAAA)
+  # run by Resolver#resolve_service. Each stage submits all its queries at
+  # the same time and the next stage starts when all of them are done.
+  class Service
+    # NAPTR service, transport and SRV prefix of the supported transports,
+    # in preference order when there are no NAPTR records.
+    SIP_TRANSPORTS = [
+      ["SIPS+D2T", :tls,  "_sips._tcp"],
+      ["SIP+D2T",  :tcp,  "_sip._tcp"],
+      ["SIP+D2U",  :udp,  "_sip._udp"],
+      ["SIP+D2S",  :sctp, "_sip._sctp"]
+    ]
+
+    DEFAULT_TRANSPORT = :udp
+    DEFAULT_PORT = 5060
+
+    # Errors meaning that the record does not exist (so the next step of the
+    # pipeline is tried).
+    MISSING_ERRORS = [:dns_error_nxdomain, :dns_error_nodata]
+
+    # Sorts SRV records by priority, and by RFC 2782 weighted random
+    # selection within the same priority.
+    def self.srv_order(records)
+      ordered = []
+      records.group_by { |srv| srv.priority }.sort.each do |priority, group|
+        # Zero weight records first, as RFC 2782 requires.
+        group = group.sort_by { |srv| srv.weight.zero? ? 0 : 1 }
+        until group.empty?
+          total = group.inject(0) { |sum, srv| sum + srv.weight }
+          pick = rand(total + 1)
+          sum = 0
+          index = group.index { |srv| (sum += srv.weight) >= pick }
+          ordered << group.delete_at(index)
+        end
+      end
+      ordered
+    end
+
+    def initialize(resolver, query, domain, options = {})
+      @resolver = resolver
+      @query = query
+      @domain = domain.chomp(".")
+      @transports = options[:transports] || SIP_TRANSPORTS
+      @transport = options[:transport] || DEFAULT_TRANSPORT
+      @port = options[:port] || DEFAULT_PORT
+      @ipv6 = options.fetch(:ipv6, true)
+      @priority = options[:priority] || Throttle::DEFAULT_PRIORITY
+      @error = nil
+    end
+
+    def run
+      # Finished in the next tick so the caller can set the callback first.
+      if address = ip_literal(@domain)
+        return @resolver.send(:later) { finish([ServiceTarget.new(@transport, @domain, @port, address)]) }
+      end
+
+      # All the names of the pipeline are fully qualified, so they are
+      # submitted as absolute names (not expanded with the search list).
+      lookup(@resolver.submit_NAPTR("#{@domain}.", :priority => @priority)) do |naptrs|
+        services = {}
+        @transports.each { |service, transport, prefix| services[service.upcase] = transport }
+        naptrs = (naptrs || []).select do |naptr|
+          naptr.flags.upcase == "S" && naptr.replacement && services[naptr.service.upcase]
+        end
+        naptrs = naptrs.sort_by { |naptr| [naptr.order, naptr.preference] }
+
+        if naptrs.any?
+          resolve_srv(naptrs.map { |naptr| [services[naptr.service.upcase], naptr.replacement] })
+        else
+          resolve_srv(@transports.map { |service, transport, prefix| [transport, "#{prefix}.#{@domain}"] })
+        end
+      end
+    end
+
+
+    private
+
+    # Invokes the block with the result of the query, or with nil and the
+    # error if it failed.
+    def lookup(query, &block)
+      # Not passed as is, as the result Array would be splatted across the
+      # block parameters.
+      query.callback { |result| block.call(result, nil) }
+      query.errback do |error|
+        @error = error unless @error && MISSING_ERRORS.include?(error)
+        block.call(nil, error)
+      end
+    end
+
+    # Waits for all the queries and invokes the block with their results
+    # (nil for those which failed) and errors in the same order.
+    def lookup_all(queries, &block)
+      results = Array.new(queries.size)
+      errors = Array.new(queries.size)
+      pending = queries.size
+      return block.call(results, errors) if pending.zero?
+      queries.each_with_index do |query, i|
+        lookup(query) do |result, error|
+          results[i], errors[i] = result, error
+          block.call(results, errors) if (pending -= 1).zero?
+        end
+      end
+    end
+
+    # Candidates are [transport, SRV name] pairs in preference order.
+    def resolve_srv(candidates)
+      queries = candidates.map { |transport, name| @resolver.send(:submit_SRV_glue, name, @priority) }
+      lookup_all(queries) do |results, errors|
+        targets = []
+        glue = {}
+        candidates.each_with_index do |(transport, name), i|
+          next unless results[i]
+          records, records_glue = results[i]
+          records_glue.each { |host, addresses| glue[host.downcase] = addresses }
+          Service.srv_order(records).each do |srv|
+            # A "." target means the service is not available.
+            next if srv.domain.empty? || srv.domain == "."
+            targets << [transport, srv.domain, srv.port]
+          end
+        end
+
+        # No SRV records at all, so resolve the domain itself (RFC 3263 4.2).
+        # Not if a lookup failed for other reasons, as records may exist.
+        if results.compact.empty?
+          if errors.all? { |error| MISSING_ERRORS.include?(error) }
+            resolve_addresses([[@transport, @domain, @port]], {})
+          else
+            finish([])
+          end
+        else
+          resolve_addresses(targets, glue)
+        end
+      end
+    end
+
+    # Targets are [transport, host, port] triplets in preference order. The
+    # glue addresses of a host replace the query of their family, so a host
+    # with only IPv4 glue still gets its AAAA records queried.
+    def resolve_addresses(targets, glue)
+      types = @ipv6 ? %w{A AAAA} : %w{A}
+      addresses = {}
+      lookups = []
+      targets.map { |transport, host, port| host.downcase }.uniq.each do |host|
+        next if ip_literal(host)
+        known = (glue[host] || []).group_by { |address| address.include?(":") ? "AAAA" : "A" }
+        addresses[host] = {}
+        types.each do |type|
+          if known[type]
+            addresses[host][type] = known[type]
+          else
+            lookups << [host, type]
+          end
+        end
+      end
+
+      queries = lookups.map { |host, type| @resolver.send("submit_#{type}", "#{host.chomp(".")}.", :priority => @priority) }
+      lookup_all(queries) do |results|
+        lookups.each_with_index { |(host, type), i| addresses[host][type] = results[i] }
+
+        finish(targets.map do |transport, host, port|
+          if address = ip_literal(host)
+            [ServiceTarget.new(transport, host, port, address)]
+          else
+            found = addresses[host.downcase]
+            types.map { |type| found[type] }.compact.flatten.map { |address| ServiceTarget.new(transport, host, port, address) }
+          end
+        end.flatten)
+      end
+    end
+
+    def finish(targets)
+      if targets.empty?
+        @resolver.send(:service_finish, @query, nil, @error || :dns_error_nodata)
+      else
+        @resolver.send(:service_finish, @query, targets, nil)
+      end
+    end
+
+    def ip_literal(host)
+      IPAddr.new(host).to_s
+    rescue ArgumentError
+      nil
+    end
+  end
+
+end
@@ -0,0 +1,126 @@
+module EventMachine::Udns
+
+  # Admission control used by EM::Udns::Resolver when the :max_inflight or
+  # :qps options are given.
+  #
+  # Queries are sent while the number of pending queries is below
+  # :max_inflight and a token is available in a bucket refilled at :qps
+  # tokens per second (holding up to :burst tokens). Otherwise they wait in
+  # a FIFO queue per priority, and higher priority queues are always
+  # drained first.
+  #
+  # A query sending several packets (one per search list expansion) has a
+  # cost of that number of pending queries and tokens. If it exceeds
+  # :max_inflight or :burst it's sent when there are no pending queries or
+  # the bucket is full, and the missing tokens are taken from the following
+  # refills.
+  class Throttle
+    PRIORITIES = [:high, :normal, :low]
+    DEFAULT_PRIORITY = :normal
+
+    attr_reader :max_inflight, :qps, :burst
+
+    def initialize(options = {})
+      @max_inflight = options[:max_inflight]
+      @qps = options[:qps]
+      @burst = options[:burst] || (@qps && [@qps.ceil, 1].max)
+      @tokens = @burst
+      @refilled_at = Time.now
+      @queues = {}
+      @stats = {}
+      PRIORITIES.each do |priority|
+        @queues[priority] = []
+        @stats[priority] = { :dispatched => 0, :total_wait => 0.0, :max_wait => 0.0 }
+      end
+    end
+
+    def self.check_priority(priority)
+      raise ArgumentError, "priority must be one of #{PRIORITIES.inspect}" unless PRIORITIES.include?(priority)
+      priority
+    end
+
+    # Whether a query with the given priority and cost can be sent right
+    # now (if so its tokens are taken). It can't if there are queued queries
+    # with the same or higher priority.
+    def admit?(priority, inflight, cost = 1, now = Time.now)
+      PRIORITIES[0..PRIORITIES.index(priority)].each do |p|
+        return false if @queues[p].any?
+      end
+      return false unless room?(inflight, cost, now)
+      take(priority, cost, 0)
+      true
+    end
+
+    def push(priority, item, cost = 1, now = Time.now)
+      @queues[priority] << [item, cost, now]
+    end
+
+    # Returns the next queued item if it can be sent right now (taking its
+    # tokens), nil otherwise. Items for which the block returns false (such
+    # as cancelled queries) are discarded without taking tokens.
+    def shift(inflight, now = Time.now)
+      PRIORITIES.each do |priority|
+        queue = @queues[priority]
+        queue.shift while queue.any? && block_given? && !yield(queue.first[0])
+        next if queue.empty?
+        item, cost, queued_at = queue.first
+        return nil unless room?(inflight, cost, now)
+        queue.shift
+        take(priority, cost, now - queued_at)
+        return item
+      end
+      nil
+    end
+
+    def empty?
+      @queues.values.all? { |queue| queue.empty? }
+    end
+
+    # Seconds until the next token is available, nil if there is no need to
+    # wait for it.
+    def delay(now = Time.now)
+      return nil unless @qps && !empty?
+      refill(now)
+      @tokens >= 1 ? nil : (1 - @tokens) / @qps
+    end
+
+    # Number of queued queries per priority.
+    def depth
+      result = {}
+      @queues.each { |priority, queue| result[priority] = queue.size }
+      result
+    end
+
+    # Number of queries sent, and total and maximum time (in seconds) they
+    # waited in the queue, per priority.
+    def stats
+      result = {}
+      @stats.each { |priority, stats| result[priority] = stats.merge(:depth => @queues[priority].size) }
+      result
+    end
+
+
+    private
+
+    def room?(inflight, cost, now)
+      return false if @max_inflight && inflight > 0 && inflight + cost > @max_inflight
+      return true unless @qps
+      refill(now)
+      @tokens >= [cost, @burst].min
+    end
+
+    def take(priority, cost, wait)
+      @tokens -= cost if @qps
+      stats = @stats[priority]
+      stats[:dispatched] += 1
+      stats[:total_wait] += wait
+      stats[:max_wait] = wait if wait > stats[:max_wait]
+    end
+
+    def refill(now)
+      @tokens = [@burst, @tokens + (now - @refilled_at) * @qps].min
+      @refilled_at = now
+    end
+  end
+
+end
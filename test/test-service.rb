@@ -0,0 +1,111 @@
+#!/usr/bin/ruby
+
+$0 = "test-service.rb"
+
+require "rubygems"
+require "socket"
+require "resolv"
+require "em-udns"
+
+
+def show_usage
+  puts <<-END_USAGE
+USAGE:
+
+  #{$0} [port]
+
+Runs a local DNS server on 127.0.0.1:port (default 5354) and checks
+EM::Udns::Resolver#resolve_service against it:
+
+  glue.test   SRV record with an A glue address in the additional section.
+  multi.test  SRV record whose target has several A records.
+END_USAGE
+end
+
+
+if ARGV[0] && ARGV[0].to_i <= 0
+  show_usage
+  exit false
+end
+
+port = (ARGV[0] || 5354).to_i
+
+IN = Resolv::DNS::Resource::IN
+
+# Answers of the local server: [name, type] => [answers, additionals].
+RECORDS = {
+  ["_sip._udp.glue.test", IN::SRV] => [[IN::SRV.new(10, 0, 5060, "sip.glue.test")],
+                                       [["sip.glue.test", IN::A.new("10.0.0.5")]]],
+  ["_sip._udp.multi.test", IN::SRV] => [[IN::SRV.new(10, 0, 5070, "sip.multi.test")], []],
+  ["sip.multi.test", IN::A] => [[IN::A.new("10.9.9.1"), IN::A.new("10.9.9.2")], []]
+}
+
+EXPECTED = {
+  "glue.test" => [[:udp, "sip.glue.test", 5060, "10.0.0.5"]],
+  "multi.test" => [[:udp, "sip.multi.test", 5070, "10.9.9.1"], [:udp, "sip.multi.test", 5070, "10.9.9.2"]]
+}
+
+
+socket = UDPSocket.new
+socket.bind("127.0.0.1", port)
+
+Thread.new do
+  loop do
+    data, (_, client_port, client_ip) = socket.recvfrom(512)
+    query = Resolv::DNS::Message.decode(data)
+    name, type = query.question.first
+    name = name.to_s.downcase
+    response = Resolv::DNS::Message.new(query.id)
+    response.qr = 1
+    response.aa = 1
+    response.add_question(name, type)
+
+    if answers = RECORDS[[name, type]]
+      answers[0].each { |rr| response.add_answer(name, 60, rr) }
+      answers[1].each { |host, rr| response.add_additional(host, 60, rr) }
+    # NODATA for the existing names, NXDOMAIN otherwise.
+    elsif !RECORDS.keys.any? { |n, t| n == name } && name !~ /\A(glue|multi)\.test\z/
+      response.rcode = Resolv::DNS::RCode::NXDomain
+    end
+
+    socket.send(response.encode, 0, client_ip, client_port)
+  end
+end
+
+
+EM.run do
+  resolver = EM::Udns::Resolver.new(:nameserver => "127.0.0.1:#{port}", :search => false)
+  EM::Udns.run resolver
+
+  failed = false
+  pending = EXPECTED.size
+
+  EXPECTED.each do |domain, expected|
+    query = resolver.resolve_service(domain)
+
+    query.callback do |targets|
+      result = targets.map { |t| [t.transport, t.host, t.port, t.address] }
+      if result == expected
+        puts "OK: #{domain} => #{result.inspect}"
+      else
+        puts "FAILED: #{domain} => #{result.inspect} (expected #{expected.inspect})"
+        failed = true
+      end
+      EM.stop if (pending -= 1).zero?
+    end
+
+    query.errback do |error|
+      puts "FAILED: #{domain} => #{error.inspect} (expected #{expected.inspect})"
+      failed = true
+      EM.stop if (pending -= 1).zero?
+    end
+  end
+
+  EM.add_timer(5) do
+    puts "FAILED: timeout"
+    failed = true
+    EM.stop
+  end
+
+  EM.add_shutdown_hook { exit !failed }
+end